@@ -25,8 +25,10 @@
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <glib.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 #include <gtk/gtk.h>
+#include <errno.h>
 #include <locale.h>
 #include <math.h>
 
@@ -53,7 +55,7 @@
 
 
 /* Command line options. */
-static gint output_size = -1; /* pixels */
+static GArray *output_sizes = NULL; /* element type gint, in pixels; needs to be freed with g_array_unref() */
 static gboolean show_overlay = FALSE;
 static gchar **filenames = NULL; /* needs to be freed with g_strfreev() */
 
@@ -78,6 +80,16 @@ static gchar **filenames = NULL; /* needs to be freed with g_strfreev() */
 #define OVERLAY_X_LARGE 8 /* pixels */
 #define OVERLAY_Y_LARGE 8 /* pixels */
 
+/* Age after which entries in the failure cache are pruned, and how often to check for them. See prune_failure_cache(). */
+#define FAILURE_CACHE_MAX_AGE (30 * 24 * 60 * 60) /* seconds */
+#define FAILURE_CACHE_PRUNE_INTERVAL (24 * 60 * 60) /* seconds */
+
+/* A single thumbnail to output: its maximum size (in pixels, or -1 to not scale it) and where to save it. */
+typedef struct {
+	gint size;
+	GFile *output_file;  /* owned */
+} OutputRequest;
+
 /**
  * calculate_file_interestingness:
  * @file_info: information about the file
@@ -319,11 +331,15 @@ done:
  * @file_uri: URI of the file whose thumbnail should be copied
  * @file_mtime: modification time of the file whose thumbnail should be copied
  * @file_mime_type: MIME type of the file whose thumbnail should be copied
+ * @thumbnail_path_out: (out) (allow-none) (transfer full): return location for the path of an existing thumbnail, or %NULL
  * @error: (allow-none): return location for a #GError, or %NULL
  *
  * Generate or look up the thumbnail for the given file. This may fail if generating the thumbnail fails (e.g. due to no thumbnailer being available for
  * the given MIME type). The thumbnail for the file will be returned as a #GdkPixbuf.
  *
+ * If @thumbnail_path_out is non-%NULL and the file already has a thumbnail in the thumbnail cache, the thumbnail isn’t loaded. Instead, its path is
+ * returned in @thumbnail_path_out (to be freed with g_free()) and %NULL is returned without setting @error. Otherwise, @thumbnail_path_out is set to %NULL.
+ *
  * In case of error, @error will be set to a %G_FILE_ERROR or %GDK_PIXBUF_ERROR and %NULL will be returned.
  *
  * Note that this may result in recursive calls to other thumbnailers, or even to gnome-directory-thumbnailer, if the @file_uri is a subdirectory.
@@ -331,14 +347,19 @@ done:
  * on the recursion depth by using the <code class="literal">GNOME_DIRECTORY_THUMBNAILER_RECURSION_LIMIT</code> environment variable. This means that
  * long chains of subdirectories (which are not in a loop) will not get thumbnailed, but that’s probably OK.
  *
- * Return value: pixbuf representing the thumbnail for the given file, or %NULL on error
+ * Return value: pixbuf representing the thumbnail for the given file, or %NULL on error or if @thumbnail_path_out was set
  */
 static GdkPixbuf *
-copy_thumbnail_from_file (GnomeDesktopThumbnailFactory *factory, const gchar *file_uri, gint64 file_mtime_unix, const gchar *file_mime_type, GError **error)
+copy_thumbnail_from_file (GnomeDesktopThumbnailFactory *factory, const gchar *file_uri, gint64 file_mtime_unix, const gchar *file_mime_type,
+                          gchar **thumbnail_path_out, GError **error)
 {
 	gchar *thumbnail_path;
 	GdkPixbuf *pixbuf = NULL;
 
+	if (thumbnail_path_out != NULL) {
+		*thumbnail_path_out = NULL;
+	}
+
 	thumbnail_path = gnome_desktop_thumbnail_factory_lookup (factory, file_uri, file_mtime_unix);
 
 	g_debug ("Getting thumbnail for file ‘%s’ from path ‘%s’.", file_uri, thumbnail_path);
@@ -397,7 +418,12 @@ copy_thumbnail_from_file (GnomeDesktopThumbnailFactory *factory, const gchar *fi
 		return pixbuf;
 	}
 
-	/* Otherwise, load up the existing thumbnail. */
+	/* Otherwise, hand the existing thumbnail back to the caller, or load it up. */
+	if (thumbnail_path_out != NULL) {
+		*thumbnail_path_out = thumbnail_path;  /* transfer ownership */
+		return NULL;
+	}
+
 	pixbuf = gdk_pixbuf_new_from_file (thumbnail_path, error);
 
 	g_free (thumbnail_path);
@@ -409,6 +435,7 @@ copy_thumbnail_from_file (GnomeDesktopThumbnailFactory *factory, const gchar *fi
  * create_thumbnail_for_directory:
  * @factory: global thumbnail factory
  * @input_directory: the directory to create a thumbnail for
+ * @thumbnail_path_out: (out) (allow-none) (transfer full): return location for the path of an existing thumbnail, or %NULL
  * @error: (allow-none): return location for a #GError, or %NULL
  *
  * Create a thumbnail representing the given @input_directory, which should be a #GFile representing an existing directory. The thumbnail
@@ -416,10 +443,13 @@ copy_thumbnail_from_file (GnomeDesktopThumbnailFactory *factory, const gchar *fi
  *
  * On error (e.g. if @input_directory doesn’t exist, isn’t a directory or is empty), %NULL will be returned and @error will be set to a %G_FILE_ERROR.
  *
- * Return value: (transfer full): a #GdkPixbuf representing the thumbnail for the directory, or %NULL on error
+ * If @thumbnail_path_out is non-%NULL and the most interesting child already has a cached thumbnail, its path is returned in @thumbnail_path_out instead
+ * of a #GdkPixbuf, as with copy_thumbnail_from_file().
+ *
+ * Return value: (transfer full) (allow-none): a #GdkPixbuf representing the thumbnail for the directory, or %NULL on error or if @thumbnail_path_out was set
  */
 static GdkPixbuf *
-create_thumbnail_for_directory (GnomeDesktopThumbnailFactory *factory, GFile *input_directory, GError **error)
+create_thumbnail_for_directory (GnomeDesktopThumbnailFactory *factory, GFile *input_directory, gchar **thumbnail_path_out, GError **error)
 {
 	GFile *interesting_file = NULL;
 	GFileInfo *interesting_file_info = NULL;
@@ -433,6 +463,10 @@ create_thumbnail_for_directory (GnomeDesktopThumbnailFactory *factory, GFile *in
 	GdkPixbuf *pixbuf = NULL;
 	GError *child_error = NULL;
 
+	if (thumbnail_path_out != NULL) {
+		*thumbnail_path_out = NULL;
+	}
+
 	interesting_file = pick_interesting_file_for_directory (input_directory, &interesting_file_info, factory, &child_error);
 	if (child_error != NULL) {
 		goto done;
@@ -451,7 +485,7 @@ create_thumbnail_for_directory (GnomeDesktopThumbnailFactory *factory, GFile *in
 	interesting_file_mtime_unix = interesting_file_mtime.tv_sec;
 #endif  /* GLIB_VERSION_2_62 */
 	interesting_file_mime_type = g_content_type_get_mime_type (g_file_info_get_content_type (interesting_file_info));
-	pixbuf = copy_thumbnail_from_file (factory, interesting_file_uri, interesting_file_mtime_unix, interesting_file_mime_type, &child_error);
+	pixbuf = copy_thumbnail_from_file (factory, interesting_file_uri, interesting_file_mtime_unix, interesting_file_mime_type, thumbnail_path_out, &child_error);
 
 done:
 	g_free (interesting_file_uri);
@@ -494,13 +528,260 @@ save_pixbuf (GdkPixbuf *pixbuf, GFile *output_file, GError **error)
 	g_free (output_filename);
 }
 
-/* Command line options. */
-static const GOptionEntry entries[] = {
-	{ "size", 's', 0, G_OPTION_ARG_INT, &output_size, N_("Maximum size of the thumbnail in pixels (maximum width or height)"), NULL },
-	{ "show-overlay", 'o', 0, G_OPTION_ARG_NONE, &show_overlay, N_("Show the normal folder icon as an overlay on the thumbnail"), NULL },
-	{ G_OPTION_REMAINING, '\0', 0, G_OPTION_ARG_FILENAME_ARRAY, &filenames, NULL, N_("[INPUT FILE] [OUTPUT FILE]") },
-	{ NULL },
-};
+/**
+ * save_thumbnail_file:
+ * @thumbnail_path: path of an existing PNG thumbnail
+ * @output_file: location to save the thumbnail to
+ * @error: (allow-none): return location for a #GError, or %NULL
+ *
+ * Save a copy of the thumbnail at @thumbnail_path in the location given by @output_file, without decoding and re-encoding it. This will overwrite any
+ * existing file at that location. For local files, GIO will reflink or copy_file_range() the data where the file system supports it. As with
+ * save_pixbuf(), the output gets default permissions and the current modification time, rather than those of @thumbnail_path.
+ *
+ * The output is byte-identical to @thumbnail_path, so it keeps the child’s <code class="literal">tEXt::Thumb::*</code> PNG metadata, including its
+ * <code class="literal">Thumb::URI</code>, <code class="literal">Thumb::MTime</code> and, for images,
+ * <code class="literal">Thumb::Image::Width</code> and <code class="literal">Thumb::Image::Height</code>. A thumbnail factory which loads the output
+ * keeps the latter two when saving the directory’s thumbnail, so they describe the child image rather than the directory. This only happens
+ * without <code class="literal">--show-overlay</code>, since the thumbnail is always decoded to draw the overlay.
+ *
+ * On error, @error will be set.
+ */
+static void
+save_thumbnail_file (const gchar *thumbnail_path, GFile *output_file, GError **error)
+{
+	GFile *thumbnail_file;
+	GFileCopyFlags flags = G_FILE_COPY_OVERWRITE;
+#ifndef GLIB_VERSION_2_80
+	GError *child_error = NULL;
+	gint64 now;
+#endif  /* !GLIB_VERSION_2_80 */
+
+	g_debug ("Copying thumbnail ‘%s’ to output file.", thumbnail_path);
+
+	/* Don’t copy the cached thumbnail’s permissions (0600) or modification time to the output. */
+#ifdef GLIB_VERSION_2_38
+	flags |= G_FILE_COPY_TARGET_DEFAULT_PERMS;
+#endif  /* GLIB_VERSION_2_38 */
+#ifdef GLIB_VERSION_2_80
+	flags |= G_FILE_COPY_TARGET_DEFAULT_MODIFIED_TIME;
+#endif  /* GLIB_VERSION_2_80 */
+
+	thumbnail_file = g_file_new_for_path (thumbnail_path);
+
+#ifdef GLIB_VERSION_2_80
+	g_file_copy (thumbnail_file, output_file, flags, NULL, NULL, NULL, error);
+#else
+	/* Reset the modification time by hand, since g_file_copy() can’t be told not to copy it. */
+	if (g_file_copy (thumbnail_file, output_file, flags, NULL, NULL, NULL, &child_error) == TRUE) {
+		now = g_get_real_time ();
+
+		if (g_file_set_attribute_uint64 (output_file, G_FILE_ATTRIBUTE_TIME_MODIFIED, now / G_USEC_PER_SEC,
+		                                 G_FILE_QUERY_INFO_NONE, NULL, &child_error) == TRUE) {
+			g_file_set_attribute_uint32 (output_file, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC, now % G_USEC_PER_SEC,
+			                             G_FILE_QUERY_INFO_NONE, NULL, &child_error);
+		}
+	}
+
+	if (child_error != NULL) {
+		g_propagate_error (error, child_error);
+	}
+#endif  /* GLIB_VERSION_2_80 */
+
+	g_object_unref (thumbnail_file);
+}
+
+/**
+ * thumbnail_size_for_output_size:
+ * @output_size: maximum size of the output thumbnail in pixels, or -1 if it won’t be scaled
+ *
+ * Match a requested output size to the thumbnail size bucket it falls in:
+ *  • GNOME_DESKTOP_THUMBNAIL_SIZE_NORMAL is up to 128px
+ *  • GNOME_DESKTOP_THUMBNAIL_SIZE_LARGE is up to 256px
+ *
+ * Return value: thumbnail size to use for @output_size
+ */
+static GnomeDesktopThumbnailSize
+thumbnail_size_for_output_size (gint output_size)
+{
+	if (output_size == -1 || output_size <= 128) {
+		return GNOME_DESKTOP_THUMBNAIL_SIZE_NORMAL;
+	} else {
+		return GNOME_DESKTOP_THUMBNAIL_SIZE_LARGE;
+	}
+}
+
+/**
+ * scale_pixbuf_for_size:
+ * @pixbuf: #GdkPixbuf to scale
+ * @output_size: maximum width or height of the scaled pixbuf in pixels, or -1 to not scale
+ *
+ * Scale @pixbuf down, preserving its aspect ratio, so that neither of its dimensions exceed @output_size. This is strictly a downscaling operation: if
+ * @pixbuf is already small enough (or @output_size is -1), a new reference to @pixbuf itself is returned.
+ *
+ * If scaling would reduce one of the dimensions to zero, %NULL is returned.
+ *
+ * Return value: (transfer full) (allow-none): the scaled pixbuf, or %NULL on error; unref with g_object_unref()
+ */
+static GdkPixbuf *
+scale_pixbuf_for_size (GdkPixbuf *pixbuf, gint output_size)
+{
+	gint original_width, original_height, scaled_width, scaled_height;
+	gdouble scale;
+
+	if (output_size == -1) {
+		return g_object_ref (pixbuf);
+	}
+
+	original_width = gdk_pixbuf_get_width (pixbuf);
+	original_height = gdk_pixbuf_get_height (pixbuf);
+
+	scale = (gdouble) output_size / (gdouble) MAX (original_width, original_height);
+
+	scaled_width = round ((gdouble) original_width * scale);
+	scaled_height = round ((gdouble) original_height * scale);
+
+	g_debug ("Calculated scaling factor %f.", scale);
+
+	/* Only do the scaling if it will be a strictly downscaling operation. */
+	if (scale >= 1.0) {
+		return g_object_ref (pixbuf);
+	}
+
+	g_debug ("Scaling thumbnail from %u×%u to %u×%u with for output size %i with scaling factor %f.",
+	         original_width, original_height, scaled_width, scaled_height, output_size, scale);
+
+	if (scaled_width == 0 || scaled_height == 0) {
+		return NULL;
+	}
+
+#if HAVE_GDK_PIXBUF_2_36_5
+	return gdk_pixbuf_scale_simple (pixbuf, scaled_width, scaled_height, GDK_INTERP_HYPER);
+#else
+	return gnome_desktop_thumbnail_scale_down_pixbuf (pixbuf, scaled_width, scaled_height);
+#endif
+}
+
+/**
+ * add_folder_overlay:
+ * @pixbuf: #GdkPixbuf to draw the overlay on
+ * @thumbnail_size: thumbnail size bucket @pixbuf was generated for
+ * @error: (allow-none): return location for a #GError, or %NULL
+ *
+ * Composite the theme’s normal folder icon onto the top-left corner of @pixbuf, modifying it in place. The overlay is sized and positioned relative to the
+ * maximum dimensions of @thumbnail_size, and scaled down proportionally if @pixbuf is smaller than that. GTK+ must have been initialised.
+ *
+ * On error (e.g. if the folder icon couldn’t be loaded), @pixbuf will not be modified and @error will be set.
+ */
+static void
+add_folder_overlay (GdkPixbuf *pixbuf, GnomeDesktopThumbnailSize thumbnail_size, GError **error)
+{
+	GtkIconTheme *icon_theme;
+	GdkPixbuf *folder_pixbuf;
+	gint scaled_width, scaled_height;
+	gint overlay_size, overlay_x, overlay_y;
+	gint scaled_overlay_size, scaled_overlay_x, scaled_overlay_y;
+	gdouble scale;
+
+	/* Re-query the dimensions since we don’t know which dimensions gdk_pixbuf_scale_simple() chose. */
+	scaled_width = gdk_pixbuf_get_width (pixbuf);
+	scaled_height = gdk_pixbuf_get_height (pixbuf);
+
+	g_debug ("Scaled width: %i, height: %i.", scaled_width, scaled_height);
+
+	g_debug ("Adding overlay image.");
+
+	switch (thumbnail_size) {
+		case GNOME_DESKTOP_THUMBNAIL_SIZE_NORMAL:
+			overlay_size = OVERLAY_SIZE_NORMAL;
+			overlay_x = OVERLAY_X_NORMAL;
+			overlay_y = OVERLAY_Y_NORMAL;
+			scale = (gdouble) MAX (scaled_width, scaled_height) / 128.0;
+			break;
+		case GNOME_DESKTOP_THUMBNAIL_SIZE_LARGE:
+			overlay_size = OVERLAY_SIZE_LARGE;
+			overlay_x = OVERLAY_X_LARGE;
+			overlay_y = OVERLAY_Y_LARGE;
+			scale = (gdouble) MAX (scaled_width, scaled_height) / 256.0;
+			break;
+		default:
+			g_assert_not_reached ();
+	}
+
+	g_debug ("Overlay size: %i, position: (%i, %i), scale: %f.", overlay_size, overlay_x, overlay_y, scale);
+
+	scaled_overlay_size = overlay_size * scale;
+	scaled_overlay_x = overlay_x * scale;
+	scaled_overlay_y = overlay_y * scale;
+
+	g_debug ("Scaled overlay size: %i, position: (%i, %i).", scaled_overlay_size, scaled_overlay_x, scaled_overlay_y);
+
+	/* Load the theme’s folder icon. */
+	icon_theme = gtk_icon_theme_get_default ();
+	folder_pixbuf = gtk_icon_theme_load_icon (icon_theme, "folder", scaled_overlay_size, 0 /* no flags */, error);
+
+	if (folder_pixbuf == NULL) {
+		/* Failed to load the icon. Shame. */
+		return;
+	}
+
+	/* Overlay it on the thumbnail. */
+	gdk_pixbuf_composite (folder_pixbuf, pixbuf,
+	                      scaled_overlay_x, scaled_overlay_y,  /* destination X, Y */
+	                      scaled_overlay_size, scaled_overlay_size,  /* destination width, height */
+	                      0.0, 0.0,  /* source offset X, Y */
+	                      1.0, 1.0,  /* source scale X, Y */
+	                      GDK_INTERP_BILINEAR,
+	                      255);  /* overall alpha */
+
+	g_object_unref (folder_pixbuf);
+}
+
+/* Free the contents of an #OutputRequest when it’s removed from its #GArray. */
+static void
+output_request_clear (gpointer data)
+{
+	OutputRequest *request = data;
+
+	g_clear_object (&request->output_file);
+}
+
+/* Sort #OutputRequests by decreasing size. Unscaled outputs (with a size of -1) are the largest of all. */
+static gint
+compare_output_requests (gconstpointer a, gconstpointer b)
+{
+	gint size_a = ((const OutputRequest *) a)->size;
+	gint size_b = ((const OutputRequest *) b)->size;
+
+	size_a = (size_a == -1) ? G_MAXINT : size_a;
+	size_b = (size_b == -1) ? G_MAXINT : size_b;
+
+	return (size_a < size_b) ? 1 : (size_a > size_b) ? -1 : 0;
+}
+
+/* Handle each --size option by appending it to output_sizes. */
+static gboolean
+parse_size_option (const gchar *option_name, const gchar *value, gpointer data, GError **error)
+{
+	gint64 parsed_size;
+	gint size;
+	gchar *end_ptr;
+
+	parsed_size = g_ascii_strtoll (value, &end_ptr, 10);
+	if (end_ptr == value || *end_ptr != '\0' || parsed_size < G_MININT || parsed_size > G_MAXINT) {
+		g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, _("Invalid size ‘%s’."), value);
+		return FALSE;
+	}
+
+	size = parsed_size;
+
+	if (output_sizes == NULL) {
+		output_sizes = g_array_new (FALSE, FALSE, sizeof (gint));
+	}
+
+	g_array_append_val (output_sizes, size);
+
+	return TRUE;
+}
 
 /* main() return statuses. */
 enum {
@@ -512,17 +793,230 @@ enum {
 	STATUS_ERROR_LOADING_OVERLAY = 5,
 };
 
+/**
+ * get_failure_cache_path:
+ * @input_directory: directory being thumbnailed
+ *
+ * Build the path of the failure cache entry for @input_directory. As with the thumbnail cache, entries are named after the MD5 hash of the directory’s URI.
+ *
+ * Return value: (transfer full): path of the cache entry; free with g_free()
+ */
+static gchar *
+get_failure_cache_path (GFile *input_directory)
+{
+	gchar *uri, *checksum, *basename, *path;
+
+	uri = g_file_get_uri (input_directory);
+	checksum = g_compute_checksum_for_string (G_CHECKSUM_MD5, uri, -1);
+	basename = g_strconcat (checksum, ".ini", NULL);
+	path = g_build_filename (g_get_user_cache_dir (), "gnome-directory-thumbnailer", "failed", basename, NULL);
+
+	g_free (basename);
+	g_free (checksum);
+	g_free (uri);
+
+	return path;
+}
+
+/**
+ * lookup_cached_failure:
+ * @input_directory: directory being thumbnailed
+ * @directory_info: information about @input_directory, including its file ID and modification time
+ * @status_out: (out): return location for the exit status of the cached failure
+ * @message_out: (out) (transfer full): return location for the error message of the cached failure; free with g_free()
+ *
+ * Look up whether a previous run found @input_directory to be empty, and the directory hasn’t changed since. Entries are only valid while the
+ * directory’s file ID and modification time match those recorded by cache_failure(), and only the failure status which cache_failure() records is
+ * accepted. Stale or corrupt entries are deleted.
+ *
+ * Return value: %TRUE if a valid cached failure was found, %FALSE otherwise
+ */
+static gboolean
+lookup_cached_failure (GFile *input_directory, GFileInfo *directory_info, gint *status_out, gchar **message_out)
+{
+	GKeyFile *key_file;
+	gchar *cache_path, *id_file = NULL, *message = NULL;
+	guint64 mtime, mtime_usec;
+	gint status;
+	gboolean valid = FALSE;
+	GError *child_error = NULL;
+
+	cache_path = get_failure_cache_path (input_directory);
+	key_file = g_key_file_new ();
+
+	if (g_key_file_load_from_file (key_file, cache_path, G_KEY_FILE_NONE, NULL) == FALSE) {
+		/* No entry. */
+		goto done;
+	}
+
+	id_file = g_key_file_get_string (key_file, "Failure", "IdFile", &child_error);
+	mtime = (child_error == NULL) ? g_key_file_get_uint64 (key_file, "Failure", "MTime", &child_error) : 0;
+	mtime_usec = (child_error == NULL) ? g_key_file_get_uint64 (key_file, "Failure", "MTimeUsec", &child_error) : 0;
+	status = (child_error == NULL) ? g_key_file_get_integer (key_file, "Failure", "Status", &child_error) : 0;
+	message = (child_error == NULL) ? g_key_file_get_string (key_file, "Failure", "Message", &child_error) : NULL;
+
+	if (child_error == NULL &&
+	    status == STATUS_ERROR_GENERATING_THUMBNAIL_EMPTY_DIRECTORY &&
+	    g_strcmp0 (id_file, g_file_info_get_attribute_string (directory_info, G_FILE_ATTRIBUTE_ID_FILE)) == 0 &&
+	    mtime == g_file_info_get_attribute_uint64 (directory_info, G_FILE_ATTRIBUTE_TIME_MODIFIED) &&
+	    mtime_usec == g_file_info_get_attribute_uint32 (directory_info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC)) {
+		g_debug ("Found cached failure in ‘%s’ with status %i.", cache_path, status);
+
+		*status_out = status;
+		*message_out = message;  /* transfer ownership */
+		message = NULL;
+		valid = TRUE;
+	} else {
+		/* The directory has changed (or the entry is corrupt), so the entry is no longer any use. */
+		g_debug ("Removing stale cached failure ‘%s’.", cache_path);
+		g_unlink (cache_path);
+	}
+
+done:
+	g_clear_error (&child_error);
+	g_free (message);
+	g_free (id_file);
+	g_key_file_free (key_file);
+	g_free (cache_path);
+
+	return valid;
+}
+
+/**
+ * prune_failure_cache:
+ * @cache_dir: directory containing the failure cache entries
+ *
+ * Delete failure cache entries which haven’t been written for %FAILURE_CACHE_MAX_AGE seconds, so that entries for directories which are never looked
+ * up again (e.g. because they were deleted or moved) don’t accumulate forever. To keep this cheap, the cache is scanned at most once every
+ * %FAILURE_CACHE_PRUNE_INTERVAL seconds, tracked using the modification time of a stamp file in @cache_dir.
+ *
+ * Errors are ignored, as it’s only an optimisation.
+ */
+static void
+prune_failure_cache (const gchar *cache_dir)
+{
+	GDir *dir;
+	const gchar *name;
+	gchar *stamp_path;
+	GStatBuf stat_buf;
+	gint64 now;
+
+	now = g_get_real_time () / G_USEC_PER_SEC;
+	stamp_path = g_build_filename (cache_dir, ".last-pruned", NULL);
+
+	if (g_stat (stamp_path, &stat_buf) == 0 && now - stat_buf.st_mtime < FAILURE_CACHE_PRUNE_INTERVAL) {
+		g_free (stamp_path);
+		return;
+	}
+
+	g_file_set_contents (stamp_path, "", 0, NULL);
+	g_free (stamp_path);
+
+	dir = g_dir_open (cache_dir, 0, NULL);
+	if (dir == NULL) {
+		return;
+	}
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		gchar *path;
+
+		if (g_str_has_suffix (name, ".ini") == FALSE) {
+			continue;
+		}
+
+		path = g_build_filename (cache_dir, name, NULL);
+
+		if (g_stat (path, &stat_buf) == 0 && now - stat_buf.st_mtime >= FAILURE_CACHE_MAX_AGE) {
+			g_debug ("Pruning old cached failure ‘%s’.", path);
+			g_unlink (path);
+		}
+
+		g_free (path);
+	}
+
+	g_dir_close (dir);
+}
+
+/**
+ * cache_failure:
+ * @input_directory: directory being thumbnailed
+ * @directory_info: information about @input_directory, queried before it was enumerated
+ * @status: exit status of the failure
+ * @message: error message of the failure
+ *
+ * Record in the failure cache that @input_directory was empty, so that lookup_cached_failure() can short-circuit repeat requests until the directory
+ * changes. @directory_info must have been queried before the directory was enumerated, so that any changes made during enumeration invalidate the entry.
+ * Old entries for other directories are pruned by prune_failure_cache().
+ *
+ * Errors writing the cache are ignored, as it’s only an optimisation.
+ */
+static void
+cache_failure (GFile *input_directory, GFileInfo *directory_info, gint status, const gchar *message)
+{
+	GKeyFile *key_file;
+	gchar *cache_path, *cache_dir, *data;
+	gsize data_length;
+	const gchar *id_file;
+	GError *child_error = NULL;
+
+	id_file = g_file_info_get_attribute_string (directory_info, G_FILE_ATTRIBUTE_ID_FILE);
+	if (id_file == NULL) {
+		/* Can’t identify the directory reliably, so don’t cache anything. */
+		return;
+	}
+
+	key_file = g_key_file_new ();
+	g_key_file_set_string (key_file, "Failure", "IdFile", id_file);
+	g_key_file_set_uint64 (key_file, "Failure", "MTime", g_file_info_get_attribute_uint64 (directory_info, G_FILE_ATTRIBUTE_TIME_MODIFIED));
+	g_key_file_set_uint64 (key_file, "Failure", "MTimeUsec", g_file_info_get_attribute_uint32 (directory_info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC));
+	g_key_file_set_integer (key_file, "Failure", "Status", status);
+	g_key_file_set_string (key_file, "Failure", "Message", message);
+
+	data = g_key_file_to_data (key_file, &data_length, NULL);
+
+	cache_path = get_failure_cache_path (input_directory);
+	cache_dir = g_path_get_dirname (cache_path);
+
+	g_debug ("Caching failure with status %i in ‘%s’.", status, cache_path);
+
+	if (g_mkdir_with_parents (cache_dir, 0700) != 0 ||
+	    g_file_set_contents (cache_path, data, data_length, &child_error) == FALSE) {
+		g_debug ("Couldn’t write cached failure: %s", (child_error != NULL) ? child_error->message : g_strerror (errno));
+		g_clear_error (&child_error);
+	} else {
+		prune_failure_cache (cache_dir);
+	}
+
+	g_free (cache_dir);
+	g_free (cache_path);
+	g_free (data);
+	g_key_file_free (key_file);
+}
+
+/* Command line options. */
+static const GOptionEntry entries[] = {
+	{ "size", 's', 0, G_OPTION_ARG_CALLBACK, parse_size_option, N_("Maximum size of the thumbnail in pixels (maximum width or height). May be repeated, once per output file; each size applies to the output file in the same position"), NULL },
+	{ "show-overlay", 'o', 0, G_OPTION_ARG_NONE, &show_overlay, N_("Show the normal folder icon as an overlay on the thumbnail"), NULL },
+	{ G_OPTION_REMAINING, '\0', 0, G_OPTION_ARG_FILENAME_ARRAY, &filenames, NULL, N_("[INPUT FILE] [OUTPUT FILE…]") },
+	{ NULL },
+};
+
 int
 main (int argc, char *argv[])
 {
 	GOptionContext *context;
 	GError *child_error = NULL;
 	int status = 0;
-	GFile *input_directory = NULL, *output_file = NULL;
+	GFile *input_directory = NULL;
+	GFileInfo *directory_info = NULL;
+	GArray *outputs = NULL;  /* element type OutputRequest */
 	GdkPixbuf *pixbuf = NULL;
+	gchar *thumbnail_path = NULL;  /* cached thumbnail to copy to the outputs instead of pixbuf, if possible */
+	gint thumbnail_width = 0, thumbnail_height = 0;
+	gboolean thumbnail_is_png = FALSE;
 	GnomeDesktopThumbnailFactory *factory = NULL;
-	GnomeDesktopThumbnailSize thumbnail_size;
-	gint scaled_width, scaled_height;  /* dimensions of the thumbnail after scaling for the --size option */
+	GnomeDesktopThumbnailSize thumbnail_size = GNOME_DESKTOP_THUMBNAIL_SIZE_NORMAL;
+	guint n_sizes, i;
 
 	/* Localisation */
 	setlocale (LC_ALL, "");
@@ -545,171 +1039,199 @@ main (int argc, char *argv[])
 		return STATUS_INVALID_OPTIONS;
 	}
 
-	/* Check both an input and an output filename were provided. Check the output size is sensible. */
-	if (filenames == NULL || g_strv_length (filenames) != 2 ||
-	    output_size < -1 || output_size == 0) {
+	/* If no --size was given, output a single unscaled thumbnail. */
+	if (output_sizes == NULL) {
+		gint unscaled_size = -1;
+
+		output_sizes = g_array_new (FALSE, FALSE, sizeof (gint));
+		g_array_append_val (output_sizes, unscaled_size);
+	}
+
+	n_sizes = output_sizes->len;
+
+	/* Check an input filename and one output filename per --size were provided. Check the output sizes are sensible. */
+	if (filenames == NULL || g_strv_length (filenames) != 1 + n_sizes) {
+		status = STATUS_INVALID_OPTIONS;
+	}
+
+	for (i = 0; i < n_sizes; i++) {
+		gint output_size = g_array_index (output_sizes, gint, i);
+
+		if (output_size < -1 || output_size == 0) {
+			status = STATUS_INVALID_OPTIONS;
+		}
+	}
+
+	if (status == STATUS_INVALID_OPTIONS) {
 		gchar *help = g_option_context_get_help (context, FALSE, NULL);
 		g_print ("%s", help);
 		g_free (help);
 
-		status = STATUS_INVALID_OPTIONS;
 		goto done;
 	}
 
-	/* Turn them into GFiles because GFiles are nice. */
+	/* Turn them into GFiles because GFiles are nice. Pair each output file with the --size given in the same position. */
 	input_directory = g_file_new_for_commandline_arg (filenames[0]);
-	output_file = g_file_new_for_commandline_arg (filenames[1]);
 
-	/* Build a thumbnail factory. Match the factory's size to the requested thumbnail size.
-	 *  • GNOME_DESKTOP_THUMBNAIL_SIZE_NORMAL is up to 128px
-	 *  • GNOME_DESKTOP_THUMBNAIL_SIZE_LARGE is up to 256px
-	 */
-	if (output_size == -1 || output_size <= 128) {
-		thumbnail_size = GNOME_DESKTOP_THUMBNAIL_SIZE_NORMAL;
-	} else {
-		thumbnail_size = GNOME_DESKTOP_THUMBNAIL_SIZE_LARGE;
+	outputs = g_array_sized_new (FALSE, FALSE, sizeof (OutputRequest), n_sizes);
+	g_array_set_clear_func (outputs, output_request_clear);
+
+	for (i = 0; i < n_sizes; i++) {
+		OutputRequest request;
+
+		request.size = g_array_index (output_sizes, gint, i);
+		request.output_file = g_file_new_for_commandline_arg (filenames[1 + i]);
+
+		/* Unscaled outputs sort as the largest, but only need a normal-sized thumbnail, so pick the largest bucket over all of the outputs. */
+		thumbnail_size = MAX (thumbnail_size, thumbnail_size_for_output_size (request.size));
+
+		g_array_append_val (outputs, request);
+	}
+
+	/* Sort the outputs largest first, so that the source thumbnail is only looked up (or generated) once, at the largest size needed, and each
+	 * smaller output can then be derived by downscaling the previous one in memory. */
+	g_array_sort (outputs, compare_output_requests);
+
+	/* Query the directory’s identity and modification time before enumerating it, so they can be used to check and update the failure cache. If
+	 * this fails, carry on without the cache; the error will be reported when enumerating the directory. */
+	directory_info = g_file_query_info (input_directory,
+	                                    G_FILE_ATTRIBUTE_ID_FILE "," G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+	                                    G_FILE_QUERY_INFO_NONE, NULL, NULL);
+
+	/* Bail out early if the directory is known to be empty. This is done before building the thumbnail factory, since that loads
+	 * all of the installed thumbnailers. */
+	if (directory_info != NULL) {
+		gchar *cached_message = NULL;
+
+		if (lookup_cached_failure (input_directory, directory_info, &status, &cached_message) == TRUE) {
+			gchar *input_directory_path = g_file_get_path (input_directory);
+			g_printerr (_("Couldn’t generate thumbnail for directory ‘%s’: %s\n"), input_directory_path, cached_message);
+			g_free (input_directory_path);
+			g_free (cached_message);
+
+			goto done;
+		}
 	}
 
+	/* Build a thumbnail factory matching the largest requested thumbnail size. */
 	factory = gnome_desktop_thumbnail_factory_new (thumbnail_size);
 
-	/* Create the thumbnail. */
-	pixbuf = create_thumbnail_for_directory (factory, input_directory, &child_error);
+	/* Create the thumbnail. If no overlay is needed, ask for the path of the chosen child’s cached thumbnail (if it has one) rather than a
+	 * decoded pixbuf, so that it can be copied straight to the output if it doesn’t need scaling. */
+	pixbuf = create_thumbnail_for_directory (factory, input_directory, (show_overlay == FALSE) ? &thumbnail_path : NULL, &child_error);
 	if (child_error != NULL) {
 		gchar *input_directory_path = g_file_get_path (input_directory);
 		g_printerr (_("Couldn’t generate thumbnail for directory ‘%s’: %s\n"), input_directory_path, child_error->message);
 		g_free (input_directory_path);
-		g_error_free (child_error);
 
 		status = (g_error_matches (child_error, G_FILE_ERROR, G_FILE_ERROR_FAILED) == TRUE) ? STATUS_ERROR_GENERATING_THUMBNAIL_EMPTY_DIRECTORY : STATUS_ERROR_GENERATING_THUMBNAIL;
+
+		/* Only cache the directory being empty, since that can only change by modifying the directory itself. (The one exception is a directory
+		 * containing only symlinks to directories, which are skipped; retargeting such a symlink to a file isn’t noticed until the entry is
+		 * pruned.) Which child gets picked, and whether it can be thumbnailed, also depends on the children’s own modification times, content
+		 * types and failed thumbnails, none of which change the directory’s modification time, so other failures aren’t cached. */
+		if (directory_info != NULL && status == STATUS_ERROR_GENERATING_THUMBNAIL_EMPTY_DIRECTORY) {
+			cache_failure (input_directory, directory_info, status, child_error->message);
+		}
+
+		g_error_free (child_error);
+
 		goto done;
 	}
 
-	/* Scale the pixbuf down if necessary. */
-	if (output_size != -1) {
-		gint original_width, original_height;
-		gdouble scale;
-
-		original_width = gdk_pixbuf_get_width (pixbuf);
-		original_height = gdk_pixbuf_get_height (pixbuf);
+	/* Read the cached thumbnail’s dimensions and format from its header. Only PNGs can be copied verbatim, since that’s the output format. */
+	if (thumbnail_path != NULL) {
+		GdkPixbufFormat *format;
 
-		scale = (gdouble) output_size / (gdouble) MAX (original_width, original_height);
+		format = gdk_pixbuf_get_file_info (thumbnail_path, &thumbnail_width, &thumbnail_height);
+		thumbnail_is_png = (format != NULL && g_strcmp0 (gdk_pixbuf_format_get_name (format), "png") == 0);
 
-		scaled_width = round ((gdouble) original_width * scale);
-		scaled_height = round ((gdouble) original_height * scale);
+		g_debug ("Cached thumbnail ‘%s’ is %i×%i (%s).", thumbnail_path, thumbnail_width, thumbnail_height, thumbnail_is_png ? "PNG" : "not PNG");
+	}
 
-		g_debug ("Calculated scaling factor %f.", scale);
+	/* Initialise GTK+ just to load the overlay icon. This seems a little wasteful, but there’s no other option. */
+	if (show_overlay == TRUE) {
+		gtk_init (&argc, &argv);
+	}
 
-		/* Only do the scaling if it will be a strictly downscaling operation. */
-		if (scale < 1.0) {
-			GdkPixbuf *scaled_pixbuf;
+	for (i = 0; i < outputs->len; i++) {
+		const OutputRequest *request = &g_array_index (outputs, OutputRequest, i);
+		GdkPixbuf *scaled_pixbuf, *output_pixbuf;
 
-			g_debug ("Scaling thumbnail from %u×%u to %u×%u with for output size %i with scaling factor %f.",
-			         original_width, original_height, scaled_width, scaled_height, output_size, scale);
+		/* If the cached thumbnail is already small enough for this output, copy it without decoding it. Outputs are sorted largest first, so
+		 * once one needs scaling, the thumbnail is decoded (once) and all remaining outputs are derived from the pixbuf as normal. */
+		if (thumbnail_path != NULL && thumbnail_is_png == TRUE &&
+		    (request->size == -1 || MAX (thumbnail_width, thumbnail_height) <= request->size)) {
+			save_thumbnail_file (thumbnail_path, request->output_file, &child_error);
+		} else {
+			if (thumbnail_path != NULL) {
+				pixbuf = gdk_pixbuf_new_from_file (thumbnail_path, &child_error);
+				g_clear_pointer (&thumbnail_path, g_free);
+
+				if (child_error != NULL) {
+					gchar *input_directory_path = g_file_get_path (input_directory);
+					g_printerr (_("Couldn’t generate thumbnail for directory ‘%s’: %s\n"), input_directory_path, child_error->message);
+					g_free (input_directory_path);
+					g_error_free (child_error);
+
+					status = STATUS_ERROR_GENERATING_THUMBNAIL;
+					goto done;
+				}
+			}
 
-			if (scaled_width == 0 || scaled_height == 0) {
+			/* Scale the pixbuf down if necessary. The result becomes the source for the next (smaller) output. */
+			scaled_pixbuf = scale_pixbuf_for_size (pixbuf, request->size);
+			if (scaled_pixbuf == NULL) {
 				status = STATUS_ERROR_GENERATING_THUMBNAIL;
 				goto done;
 			}
 
-#if HAVE_GDK_PIXBUF_2_36_5
-			scaled_pixbuf = gdk_pixbuf_scale_simple (pixbuf, scaled_width, scaled_height, GDK_INTERP_HYPER);
-#else
-			scaled_pixbuf = gnome_desktop_thumbnail_scale_down_pixbuf (pixbuf, scaled_width, scaled_height);
-#endif
-
 			g_object_unref (pixbuf);
 			pixbuf = scaled_pixbuf;  /* transfer ownership */
 			scaled_pixbuf = NULL;
-		}
-	}
-
-	/* Add the normal folder icon as an overlay if necessary. */
-	if (show_overlay == TRUE) {
-		GtkIconTheme *icon_theme;
-		GdkPixbuf *folder_pixbuf;
-		gint overlay_size, overlay_x, overlay_y;
-		gint scaled_overlay_size, scaled_overlay_x, scaled_overlay_y;
-		gdouble scale;
-
-		/* Re-query the dimensions since we don’t know which dimensions gdk_pixbuf_scale_simple() chose. */
-		scaled_width = gdk_pixbuf_get_width (pixbuf);
-		scaled_height = gdk_pixbuf_get_height (pixbuf);
 
-		g_debug ("Scaled width: %i, height: %i.", scaled_width, scaled_height);
+			/* Add the normal folder icon as an overlay if necessary. Since that modifies the pixbuf, work on a copy unless this is the last
+			 * output, so that the overlay doesn’t end up scaled down into the smaller outputs. */
+			if (show_overlay == TRUE) {
+				output_pixbuf = (i + 1 < outputs->len) ? gdk_pixbuf_copy (pixbuf) : g_object_ref (pixbuf);
 
-		g_debug ("Adding overlay image.");
+				add_folder_overlay (output_pixbuf, thumbnail_size_for_output_size (request->size), &child_error);
+				if (child_error != NULL) {
+					g_printerr (_("Couldn’t load folder overlay icon: %s\n"), child_error->message);
+					g_error_free (child_error);
+					g_object_unref (output_pixbuf);
 
-		/* Initialise GTK+ just to load the icon. This seems a little wasteful, but there’s no other option. */
-		gtk_init (&argc, &argv);
+					status = STATUS_ERROR_LOADING_OVERLAY;
+					goto done;
+				}
+			} else {
+				output_pixbuf = g_object_ref (pixbuf);
+			}
 
-		switch (thumbnail_size) {
-			case GNOME_DESKTOP_THUMBNAIL_SIZE_NORMAL:
-				overlay_size = OVERLAY_SIZE_NORMAL;
-				overlay_x = OVERLAY_X_NORMAL;
-				overlay_y = OVERLAY_Y_NORMAL;
-				scale = (gdouble) MAX (scaled_width, scaled_height) / 128.0;
-				break;
-			case GNOME_DESKTOP_THUMBNAIL_SIZE_LARGE:
-				overlay_size = OVERLAY_SIZE_LARGE;
-				overlay_x = OVERLAY_X_LARGE;
-				overlay_y = OVERLAY_Y_LARGE;
-				scale = (gdouble) MAX (scaled_width, scaled_height) / 256.0;
-				break;
-			default:
-				g_assert_not_reached ();
+			/* Save it. */
+			save_pixbuf (output_pixbuf, request->output_file, &child_error);
+			g_object_unref (output_pixbuf);
 		}
 
-		g_debug ("Overlay size: %i, position: (%i, %i), scale: %f.", overlay_size, overlay_x, overlay_y, scale);
-
-		scaled_overlay_size = overlay_size * scale;
-		scaled_overlay_x = overlay_x * scale;
-		scaled_overlay_y = overlay_y * scale;
-
-		g_debug ("Scaled overlay size: %i, position: (%i, %i).", scaled_overlay_size, scaled_overlay_x, scaled_overlay_y);
-
-		/* Load the theme’s folder icon. */
-		icon_theme = gtk_icon_theme_get_default ();
-		folder_pixbuf = gtk_icon_theme_load_icon (icon_theme, "folder", scaled_overlay_size, 0 /* no flags */, &child_error);
-		g_object_unref (icon_theme);
-
 		if (child_error != NULL) {
-			/* Failed to load the icon. Shame. */
-			g_printerr (_("Couldn’t load folder overlay icon: %s\n"), child_error->message);
+			gchar *output_file_path = g_file_get_path (request->output_file);
+			g_printerr (_("Couldn’t save thumbnail to ‘%s’: %s\n"), output_file_path, child_error->message);
+			g_free (output_file_path);
 			g_error_free (child_error);
 
-			status = STATUS_ERROR_LOADING_OVERLAY;
+			status = STATUS_ERROR_SAVING_THUMBNAIL;
 			goto done;
 		}
-
-		/* Overlay it on the thumbnail. */
-		gdk_pixbuf_composite (folder_pixbuf, pixbuf,
-		                      scaled_overlay_x, scaled_overlay_y,  /* destination X, Y */
-		                      scaled_overlay_size, scaled_overlay_size,  /* destination width, height */
-		                      0.0, 0.0,  /* source offset X, Y */
-		                      1.0, 1.0,  /* source scale X, Y */
-		                      GDK_INTERP_BILINEAR,
-		                      255);  /* overall alpha */
-
-		g_object_unref (folder_pixbuf);
-	}
-
-	/* Save it. */
-	save_pixbuf (pixbuf, output_file, &child_error);
-	if (child_error != NULL) {
-		gchar *output_file_path = g_file_get_path (output_file);
-		g_printerr (_("Couldn’t save thumbnail to ‘%s’: %s\n"), output_file_path, child_error->message);
-		g_free (output_file_path);
-		g_error_free (child_error);
-
-		status = STATUS_ERROR_SAVING_THUMBNAIL;
-		goto done;
 	}
 
 done:
 	g_strfreev (filenames);
+	g_clear_pointer (&output_sizes, g_array_unref);
+	g_clear_pointer (&outputs, g_array_unref);
+	g_clear_object (&directory_info);
 	g_clear_object (&input_directory);
-	g_clear_object (&output_file);
 	g_clear_object (&pixbuf);
+	g_free (thumbnail_path);
 	g_clear_object (&factory);
 
 	g_debug ("Exiting with status %i.", status);